@@ -0,0 +1,121 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+/*
+Library interface to extract, for programs such as PDF interpreters that can
+give us spans and glyphs directly, instead of writing XML intermediate format
+for 'extract -m raw' to parse.
+
+Build with 'make build=<build> lib', which creates
+build/libextract-<build>.a and build/libextract-<build>.so.
+
+Usage:
+
+    extract_t* extract;
+    extract_begin_document(&extract, gs, fast, verbose);
+    for each page:
+        extract_begin_page(extract);
+        for each span:
+            extract_add_span(extract, ctm, trm, font_name, wmode);
+            for each glyph in span:
+                extract_add_char(extract, x, y, adv, ucs);
+        extract_end_page(extract);
+    extract_write_docx(extract, "out.docx", "template.docx", spacing);
+    extract_end_document(&extract);
+
+Alternatively, to try different space and paragraph factors, call
+extract_write_content() for each pair of factors instead of
+extract_write_docx().
+
+Values are as in the XML intermediate format. All functions except
+extract_end_document() return 0 on success or -1 with errno set; calling them
+in the wrong order fails with errno=EINVAL. If <verbose> is true, diagnostics
+are written to stderr.
+
+extract_write_docx() runs the 'unzip' and 'zip' commands with the paths
+quoted, so paths may contain spaces and other characters special to the shell
+but must not contain a single-quote character.
+*/
+
+#ifdef __GNUC__
+    #define EXTRACT_API __attribute__((visibility("default")))
+#else
+    #define EXTRACT_API
+#endif
+
+typedef struct extract_t extract_t;
+
+/* Creates new extract_t in *o_extract.
+
+gs:
+    If true, glyph y values increase down the page, as with ghostscript's
+    txtwrite device; otherwise they are as from mupdf's raw device.
+fast:
+    As for 'extract --mode fast'.
+verbose:
+    If false, we don't write diagnostics to stderr. This applies to all
+    extract_t's in the process, and is set by each call.
+*/
+EXTRACT_API int extract_begin_document(extract_t** o_extract, int gs, int fast, int verbose);
+
+/* Starts a new page. */
+EXTRACT_API int extract_begin_page(extract_t* extract);
+
+/* Starts a new span in the current page, finishing any previous span.
+
+ctm, trm:
+    Matrices a, b, c, d, e, f.
+font_name:
+    May include a subset prefix such as "ABCDEF+", which is ignored. Copied.
+wmode:
+    1 for vertical writing, otherwise 0.
+*/
+EXTRACT_API int extract_add_span(
+        extract_t* extract,
+        const float ctm[6],
+        const float trm[6],
+        const char* font_name,
+        int wmode
+        );
+
+/* Appends a glyph to the current span. */
+EXTRACT_API int extract_add_char(extract_t* extract, float x, float y, float adv, int ucs);
+
+/* Finishes the current page. */
+EXTRACT_API int extract_end_page(extract_t* extract);
+
+/* Joins spans into lines and paragraphs and writes them to .docx file <path>,
+using <template_path> as template. <spacing> is as for 'extract -s'. May only
+be called once, after the last page. Fails with errno=EINVAL if <path> or
+<template_path> contains a single-quote character. */
+EXTRACT_API int extract_write_docx(
+        extract_t* extract,
+        const char* path,
+        const char* template_path,
+        int spacing
+        );
+
+/* Writes the raw .docx content that extract_write_docx() would embed in
+word/document.xml, as for 'extract --o-content', to <path>, using <space_factor>
+and <paragraph_factor> as for 'extract --space-factor' and
+'--paragraph-factor'. <spacing> is as for 'extract -s'.
+
+May be called any number of times after the last page, as for 'extract
+--sweep'. Spans are only joined into lines once, by the first call, and each
+call then inserts spaces and makes paragraphs again, which is much quicker
+than converting the document again. Fails with errno=EINVAL if <fast> was
+true or extract_write_docx() has been called, and extract_write_docx() fails
+with errno=EINVAL once this has been called. */
+EXTRACT_API int extract_write_content(
+        extract_t* extract,
+        const char* path,
+        float space_factor,
+        float paragraph_factor,
+        int spacing
+        );
+
+/* Frees *p_extract and sets it to NULL. Does nothing if *p_extract is
+NULL. */
+EXTRACT_API void extract_end_document(extract_t** p_extract);
+
+#endif
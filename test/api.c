@@ -0,0 +1,161 @@
+/* Usage: api <intermediate.xml> <template.docx> <out.docx> <out-content>
+
+Feeds spans and glyphs from intermediate file written by mutool's raw device
+to the library interface in extract.h, and writes .docx file, so that
+test/check.sh can compare the result with that of 'extract -m raw'. Then we
+do the same again but write content with two pairs of factors using
+extract_write_content(), for comparison with 'extract --sweep'. We turn
+off the library's diagnostics, so nothing is written to stderr unless there is
+an error.
+
+We assume that each tag is on a separate line, as written by mutool. We also
+check that calling functions in the wrong order fails with errno=EINVAL.
+*/
+
+#include "../extract.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Returns pointer to value of attribute <name> in <line>, or NULL if not
+found. */
+static const char* attribute(const char* line, const char* name)
+{
+    char key[64];
+    snprintf(key, sizeof(key), " %s=\"", name);
+    const char* p = strstr(line, key);
+    if (!p) return NULL;
+    return p + strlen(key);
+}
+
+static int read_matrix(const char* line, const char* name, float m[6])
+{
+    const char* value = attribute(line, name);
+    if (!value) return -1;
+    if (sscanf(value, "%f %f %f %f %f %f", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) {
+        return -1;
+    }
+    return 0;
+}
+
+static int read_span(extract_t* extract, const char* line)
+{
+    float   ctm[6];
+    float   trm[6];
+    char    font_name[256];
+    if (read_matrix(line, "ctm", ctm)) return -1;
+    if (read_matrix(line, "trm", trm)) return -1;
+    const char* value = attribute(line, "font_name");
+    if (!value || sscanf(value, "%255[^\"]", font_name) != 1) return -1;
+    value = attribute(line, "wmode");
+    if (!value) return -1;
+    return extract_add_span(extract, ctm, trm, font_name, atoi(value));
+}
+
+static int read_char(extract_t* extract, const char* line)
+{
+    const char* x = attribute(line, "x");
+    const char* y = attribute(line, "y");
+    const char* adv = attribute(line, "adv");
+    const char* ucs = attribute(line, "ucs");
+    if (!x || !y || !adv || !ucs) return -1;
+    return extract_add_char(extract, atof(x), atof(y), atof(adv), atoi(ucs));
+}
+
+/* Returns 0 if <e> is -1 with errno=EINVAL, as expected when a function is
+called in the wrong order. */
+static int check_einval(int e, const char* what)
+{
+    if (e == -1 && errno == EINVAL) return 0;
+    fprintf(stderr, "%s: expected -1 with errno=EINVAL, got %i\n", what, e);
+    return -1;
+}
+
+/* Passes the spans and glyphs in <in> to <extract>. Returns 0, or -1 if
+error. */
+static int read_input(extract_t* extract, FILE* in, const char* path)
+{
+    char    line[4096];
+    int     line_num = 0;
+    rewind(in);
+    while (fgets(line, sizeof(line), in)) {
+        int e = 0;
+        line_num += 1;
+        if (!strncmp(line, "<page", 5)) e = extract_begin_page(extract);
+        else if (!strncmp(line, "</page", 6)) e = extract_end_page(extract);
+        else if (!strncmp(line, "<span", 5)) e = read_span(extract, line);
+        else if (!strncmp(line, "<char", 5)) e = read_char(extract, line);
+        if (e) {
+            fprintf(stderr, "%s:%i: failed: %s", path, line_num, line);
+            return -1;
+        }
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int         ret = -1;
+    extract_t*  extract = NULL;
+    FILE*       in = NULL;
+    char*       content_path = NULL;
+
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s <intermediate.xml> <template.docx> <out.docx> <out-content>\n", argv[0]);
+        goto end;
+    }
+    in = fopen(argv[1], "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+        goto end;
+    }
+
+    /* Write .docx file. */
+    if (extract_begin_document(&extract, 0 /*gs*/, 0 /*fast*/, 0 /*verbose*/)) goto end;
+    if (check_einval(extract_add_char(extract, 0, 0, 0, 'x'), "extract_add_char() before page")) goto end;
+    if (read_input(extract, in, argv[1])) goto end;
+    if (check_einval(extract_end_page(extract), "extract_end_page() outside page")) goto end;
+    if (extract_write_docx(extract, argv[3], argv[2], 1 /*spacing*/)) goto end;
+    if (check_einval(extract_begin_page(extract), "extract_begin_page() after extract_write_docx()")) goto end;
+    if (check_einval(
+            extract_write_docx(extract, argv[3], argv[2], 1 /*spacing*/),
+            "second extract_write_docx()"
+            )) goto end;
+    if (check_einval(
+            extract_write_content(extract, argv[4], 0.25, 1.5, 1 /*spacing*/),
+            "extract_write_content() after extract_write_docx()"
+            )) goto end;
+    extract_end_document(&extract);
+    extract_end_document(&extract);
+
+    /* Write content with the default factors to <out-content>.0, and with
+    other factors to <out-content>.1, as for 'extract --sweep "0.25,1.5
+    0.5,1.0"'. */
+    content_path = malloc(strlen(argv[4]) + 3);
+    if (!content_path) goto end;
+    if (extract_begin_document(&extract, 0 /*gs*/, 0 /*fast*/, 0 /*verbose*/)) goto end;
+    if (read_input(extract, in, argv[1])) goto end;
+    sprintf(content_path, "%s.0", argv[4]);
+    if (extract_write_content(extract, content_path, 0.25, 1.5, 1 /*spacing*/)) goto end;
+    sprintf(content_path, "%s.1", argv[4]);
+    if (extract_write_content(extract, content_path, 0.5, 1.0, 1 /*spacing*/)) goto end;
+    if (check_einval(
+            extract_write_docx(extract, argv[3], argv[2], 1 /*spacing*/),
+            "extract_write_docx() after extract_write_content()"
+            )) goto end;
+
+    ret = 0;
+
+    end:
+    extract_end_document(&extract);
+    free(content_path);
+    if (in) fclose(in);
+    return (ret) ? 1 : 0;
+}
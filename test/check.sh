@@ -0,0 +1,310 @@
+#!/bin/sh
+#
+# Usage: test/check.sh <extract-exe> <api-exe> <out-dir>
+#
+# Runs extract on test/fixture.mu.xml with different options, and checks that
+# modes which are only supposed to change how the work is done give the same
+# --o-content output. The fixture has a page of two columns, a page where every
+# span is duplicated, and a page with a scaling ctm. Word spans have no
+# trailing spaces, so joining them into lines inserts spaces.
+#
+# Output files are written to <out-dir>/<name>.content.xml. <api-exe> is
+# built from test/api.c.
+
+set -e
+
+exe=$1
+api=$2
+out=$3
+fixture=test/fixture.mu.xml
+mkdir -p $out
+
+# run <name> <extract-args...>
+run()
+{
+    name=$1
+    shift
+    echo "== $name: $*"
+    $exe -t template.docx -o $out/$name.docx --o-content $out/$name.content.xml "$@" > $out/$name.log 2>&1 || {
+        cat $out/$name.log
+        echo "== $name: failed"
+        exit 1
+    }
+}
+
+# fails <name> <extract-args...>
+fails()
+{
+    name=$1
+    shift
+    echo "== $name: $* (should fail)"
+    if $exe -t template.docx -o $out/$name.docx --o-content $out/$name.content.xml "$@" > $out/$name.log 2>&1; then
+        echo "== $name: did not fail"
+        exit 1
+    fi
+}
+
+# same <name-a> <name-b>
+same()
+{
+    diff -u $out/$1.content.xml $out/$2.content.xml
+}
+
+# For spans that are aligned, as in the fixture, lines joined while reading with
+# --online 1 must give the same output as joining everything in make_lines().
+for mode in default dedup coalesce xycut; do
+    case $mode in
+        default)    args="";;
+        *)          args="--$mode 1";;
+    esac
+    run $mode-online0 -m raw -i $fixture $args --online 0
+    run $mode-online1 -m raw -i $fixture $args --online 1
+    same $mode-online0 $mode-online1
+done
+
+# --online 1 is approximate where spans are not quite aligned, but must keep all
+# glyphs. We move each span of the fixture up or down by up to 0.3 points, and
+# compare the sorted non-space characters of the content.
+awk 'BEGIN { srand(1) }
+    /^<span/ { dy = rand() * 0.6 - 0.3 }
+    /^<char/ {
+        match($0, / y="[^"]*"/)
+        y = substr($0, RSTART + 4, RLENGTH - 5)
+        $0 = substr($0, 1, RSTART - 1) " y=\"" (y + dy) "\"" substr($0, RSTART + RLENGTH)
+    }
+    { print }' $fixture > $out/fixture-jitter.mu.xml
+for online in 0 1; do
+    run jitter-online$online -m raw -i $out/fixture-jitter.mu.xml --online $online
+    sed 's/<[^>]*>//g' $out/jitter-online$online.content.xml | tr -d ' \n' | fold -w 1 | sort > $out/jitter-online$online.chars
+done
+diff -u $out/jitter-online0.chars $out/jitter-online1.chars
+
+# --fixed 1 must give the same output as --fixed 0 for the fixture, whose
+# spans are well within the alignment tolerance, including when combined with
+# other modes. With jittered baselines, spans can be joined differently, but
+# all glyphs must be kept.
+for mode in default online dedup xycut; do
+    case $mode in
+        default)    args="";;
+        *)          args="--$mode 1";;
+    esac
+    run $mode-fixed -m raw -i $fixture $args --fixed 1
+    case $mode in
+        online)     same default-online1 $mode-fixed;;
+        default)    same default-online0 $mode-fixed;;
+        *)          same $mode-online0 $mode-fixed;;
+    esac
+done
+run jitter-fixed -m raw -i $out/fixture-jitter.mu.xml --fixed 1
+sed 's/<[^>]*>//g' $out/jitter-fixed.content.xml | tr -d ' \n' | fold -w 1 | sort > $out/jitter-fixed.chars
+diff -u $out/jitter-online0.chars $out/jitter-fixed.chars
+
+# --dedup 1 must remove the 75 copies of spans on page 2 of the fixture, giving
+# the same output as a copy of the fixture without them.
+grep -q "Removed 75 duplicate spans and 376 duplicate glyphs" $out/dedup-online0.log || {
+    cat $out/dedup-online0.log
+    echo "== dedup: did not remove 75 spans"
+    exit 1
+}
+awk '/^<page/ { page += 1 }
+    /^<span/ { span = "" }
+    !/^<span/ && span == "" { print; next }
+    { span = span $0 "\n" }
+    /^<\/span>/ {
+        if (page != 2 || span != previous) printf "%s", span
+        previous = span
+        span = ""
+    }' $fixture > $out/fixture-undup.mu.xml
+run undup -m raw -i $out/fixture-undup.mu.xml
+same dedup-online0 undup
+
+# Copies that only partly overlap earlier spans must be trimmed. On page 2 of
+# the de-duplicated fixture, we split each span after its second glyph, and draw
+# a copy of the whole span moved right by 0.3 points between the two parts. For
+# alternate spans we draw the second part first. So the copy starts or ends
+# with glyphs that have already been drawn, which are removed, and the part of
+# the span that is drawn after the copy is removed.
+awk 'function shift(c) {
+        match(c, / x="[^"]*"/)
+        return substr(c, 1, RSTART - 1) " x=\"" (substr(c, RSTART + 4, RLENGTH - 5) + 0.3) "\"" substr(c, RSTART + RLENGTH)
+    }
+    /^<page/ { page += 1 }
+    page != 2 { print; next }
+    /^<span/ { head = $0; n = 0; next }
+    /^<char/ { chars[n++] = $0; next }
+    /^<\/span>/ {
+        a = head "\n"
+        b = head "\n"
+        copy = head "\n"
+        for (i=0; i<n; ++i) {
+            if (i < 2) a = a chars[i] "\n"
+            else b = b chars[i] "\n"
+            copy = copy shift(chars[i]) "\n"
+        }
+        if (spans++ % 2) printf "%s</span>\n%s</span>\n%s</span>\n", b, copy, a
+        else printf "%s</span>\n%s</span>\n%s</span>\n", a, copy, b
+        next
+    }
+    { print }' $out/fixture-undup.mu.xml > $out/fixture-overlap.mu.xml
+run overlap -m raw -i $out/fixture-overlap.mu.xml --dedup 1
+grep -q "Removed 75 duplicate spans and 376 duplicate glyphs" $out/overlap.log || {
+    cat $out/overlap.log
+    echo "== overlap: did not remove 75 spans"
+    exit 1
+}
+same undup overlap
+
+# --xycut 1 must keep the two columns on page 1 of the fixture apart. We make
+# the text of each column's two paragraphs from the fixture, and compare with
+# the first four paragraphs of the content, ignoring their order.
+awk '/^<page/ { page += 1 }
+    page != 1 { next }
+    /^<span/ { word = "" }
+    /^<char/ {
+        match($0, / x="[^"]*"/)
+        x = substr($0, RSTART + 4, RLENGTH - 5) + 0
+        match($0, / y="[^"]*"/)
+        y = substr($0, RSTART + 4, RLENGTH - 5) + 0
+        match($0, / ucs="[^"]*"/)
+        word = word sprintf("%c", substr($0, RSTART + 6, RLENGTH - 7) + 0)
+        if (x < 330) column = "left"
+        else column = "right"
+        if (y < 140) paragraph = 1
+        else paragraph = 2
+    }
+    /^<\/span>/ {
+        key = column " " paragraph
+        if (key in text) text[key] = text[key] " " word
+        else text[key] = word
+    }
+    END { for (key in text) print text[key] }' $fixture | sort > $out/xycut-columns.txt
+sed 's/<[^>]*>//g' $out/xycut-online0.content.xml | grep . | head -n 4 | sort > $out/xycut-page1.txt
+diff -u $out/xycut-columns.txt $out/xycut-page1.txt
+
+# Spans sent through shared memory by the reference producer must give the same
+# output as reading the file directly.
+shm=/extract-check-$$
+echo "== shm-producer: -m raw -i $fixture --o-shm $shm"
+$exe -m raw -i $fixture --o-shm $shm > $out/shm-producer.log 2>&1 &
+producer=$!
+run shm -m shm -i $shm
+wait $producer || {
+    cat $out/shm-producer.log
+    echo "== shm-producer: failed"
+    exit 1
+}
+same default-online0 shm
+
+# -m auto must detect that the fixture is from mupdf, from a file or a pipe.
+run auto -m auto -i $fixture
+same default-online0 auto
+echo "== auto-pipe: cat $fixture | -m auto -i -"
+cat $fixture | $exe -m auto -i - -t template.docx -o $out/auto-pipe.docx --o-content $out/auto-pipe.content.xml > $out/auto-pipe.log 2>&1
+same default-online0 auto-pipe
+
+# Converting to binary format with --o-binary and reading that with -m bin must
+# give the same output.
+echo "== binary: -m raw -i $fixture --o-binary $out/fixture.bin"
+$exe -m raw -i $fixture --o-binary $out/fixture.bin > $out/binary.log 2>&1 || {
+    cat $out/binary.log
+    echo "== binary: failed"
+    exit 1
+}
+run bin -m bin -i $out/fixture.bin
+same default-online0 bin
+run bin-online -m bin -i $out/fixture.bin --online 1
+same default-online1 bin-online
+
+# A binary file with an invalid header must be rejected. We set the 32-bit gs
+# field at offset 16 to 0x740000.
+cp $out/fixture.bin $out/fixture-bad-gs.bin
+printf '\164' | dd of=$out/fixture-bad-gs.bin bs=1 seek=18 conv=notrunc 2>/dev/null
+fails bin-bad-gs -m bin -i $out/fixture-bad-gs.bin
+
+# Selecting all pages must give the same output as reading the whole file, and
+# selecting pages after the last page must fail. We use a copy of the fixture
+# because --pages writes a .pageindex file next to the input.
+cp $fixture $out/fixture.mu.xml
+run pages-all -m raw -i $out/fixture.mu.xml --pages 1-
+same default-online0 pages-all
+run pages-all-again -m raw -i $out/fixture.mu.xml --pages 1,2-3
+same default-online0 pages-all-again
+fails pages-after-last -m raw -i $out/fixture.mu.xml --pages 4-
+
+# Parsing pages concurrently must give the same output, and must not create a
+# .pageindex file.
+cp $fixture $out/fixture-threads.mu.xml
+run threads -m raw -i $out/fixture-threads.mu.xml --threads 4
+same default-online0 threads
+if [ -e $out/fixture-threads.mu.xml.pageindex ]; then
+    echo "== threads: created .pageindex file"
+    exit 1
+fi
+
+# Each output of --sweep must be the same as a separate run with its factors.
+run sweep -m raw -i $fixture --sweep "0.25,1.5 0.5,1.0"
+run factors -m raw -i $fixture --space-factor 0.5 --paragraph-factor 1.0
+diff -u $out/default-online0.content.xml $out/sweep.content.xml.0
+diff -u $out/factors.content.xml $out/sweep.content.xml.1
+fails sweep-factors -m raw -i $fixture --sweep "0.25,1.5" --space-factor 0.5
+
+# Reading from a pipe must give the same output, including when the producer
+# writes slowly.
+echo "== pipe: cat $fixture | -m raw -i -"
+cat $fixture | $exe -m raw -i - -t template.docx -o $out/pipe.docx --o-content $out/pipe.content.xml > $out/pipe.log 2>&1
+same default-online0 pipe
+echo "== pipe-slow: (head; sleep; tail) | -m raw -i -"
+(head -c 50000 $fixture; sleep 1; tail -c +50001 $fixture) | $exe -m raw -i - -t template.docx -o $out/pipe-slow.docx --o-content $out/pipe-slow.content.xml > $out/pipe-slow.log 2>&1
+same default-online0 pipe-slow
+
+# Input from a pipe is pushed to the XML parser as it arrives, so tags and
+# attribute values can be split between chunks. Check a few such splits.
+for split in 100 4097 65537 100003; do
+    echo "== pipe-split-$split: (head; sleep; tail) | -m raw -i -"
+    (head -c $split $fixture; sleep 0.2; tail -c +$(($split + 1)) $fixture) | $exe -m raw -i - -t template.docx -o $out/pipe-split-$split.docx --o-content $out/pipe-split-$split.content.xml > $out/pipe-split-$split.log 2>&1
+    same default-online0 pipe-split-$split
+done
+
+# Reading gzip-compressed input, from a file or a pipe, must give the same
+# output.
+gzip -c $fixture > $out/fixture.mu.xml.gz
+run gzip -m auto -i $out/fixture.mu.xml.gz
+same default-online0 gzip
+echo "== gzip-pipe: gzip -c $fixture | -m raw -i -"
+gzip -c $fixture | $exe -m raw -i - -t template.docx -o $out/gzip-pipe.docx --o-content $out/gzip-pipe.content.xml > $out/gzip-pipe.log 2>&1
+same default-online0 gzip-pipe
+
+# Likewise for zstd, if <extract-exe> was built with 'make zstd=1', which
+# 'make check' passes to us as $zstd.
+if [ "$zstd" = 1 ]; then
+    zstd -q -c $fixture > $out/fixture.mu.xml.zst
+    run zstd -m auto -i $out/fixture.mu.xml.zst
+    same default-online0 zstd
+    echo "== zstd-pipe: zstd -c $fixture | -m raw -i -"
+    zstd -q -c $fixture | $exe -m raw -i - -t template.docx -o $out/zstd-pipe.docx --o-content $out/zstd-pipe.content.xml > $out/zstd-pipe.log 2>&1
+    same default-online0 zstd-pipe
+fi
+
+# Passing the fixture's spans and glyphs to the library must give the same
+# document as the command line tool. The library must not write diagnostics
+# when not verbose, and must quote paths that contain characters special to the
+# shell.
+cp template.docx "$out/api template;x.docx"
+echo "== api: $fixture"
+$api $fixture "$out/api template;x.docx" "$out/api out;x.docx" $out/api.content.xml > $out/api.log 2>&1 || {
+    cat $out/api.log
+    echo "== api: failed"
+    exit 1
+}
+if [ -s $out/api.log ]; then
+    cat $out/api.log
+    echo "== api: wrote diagnostics"
+    exit 1
+fi
+unzip -p $out/default-online0.docx word/document.xml > $out/default-online0.document.xml
+unzip -p "$out/api out;x.docx" word/document.xml > $out/api.document.xml
+diff -u $out/default-online0.document.xml $out/api.document.xml
+diff -u $out/sweep.content.xml.0 $out/api.content.xml.0
+diff -u $out/sweep.content.xml.1 $out/api.content.xml.1
+
+echo "== All checks succeeded."